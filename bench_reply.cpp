@@ -0,0 +1,76 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "ftpreply.h"
+
+using namespace std;
+
+/**
+ *  bench_reply.cpp
+ * 
+ *  Measures how many replies per second ftpreply.h parses,
+ *  for a single-line reply, a multi-line login banner and a
+ *  227 PASV reply. Build and run with ./benchscript.sh.
+ */
+
+// Keeps the compiler from dropping the parsing
+volatile long long sink;
+
+/**
+ *  bench(const char* name, const string& reply, bool pasv)
+ * 
+ *  Parses reply over and over for about a second and
+ *  prints the rate.
+ * 
+ *  @param name Label for the output
+ *  @param reply Reply text, as read from the control connection
+ *  @param pasv True to time parsePasv(), otherwise parseReply()
+ */
+void bench(const char* name, const string& reply, bool pasv)
+{
+    const long long BATCH = 100000;
+    long long count = 0;
+    long long total = 0;
+
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    while(elapsed < 1.0)
+    {
+        for(long long i = 0; i < BATCH; i++)
+        {
+            if(pasv)
+            {
+                uint32_t address;
+                uint16_t port;
+                total += parsePasv(reply.data(), reply.size(), &address, &port) ? port : 0;
+            }
+            else
+            {
+                int code;
+                total += parseReply(reply.data(), reply.size(), &code) + code;
+            }
+        }
+        count += BATCH;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    sink = total;
+
+    printf("%-12s %6zu bytes  %12.0f replies/sec  %8.1f MB/s\n", name, reply.size(), 
+           count / elapsed, count * reply.size() / elapsed / 1e6);
+}
+
+int main()
+{
+    string banner;
+    for(int i = 0; i < 20; i++)
+    {
+        banner += "230-Line " + to_string(i) + " of the welcome message\r\n";
+    }
+    banner += "230 Logged in\r\n";
+
+    bench("single", "226 Transfer complete\r\n", false);
+    bench("multi-line", banner, false);
+    bench("pasv", "227 Entering Passive Mode (192,168,1,20,195,80)\r\n", true);
+    return 0;
+}
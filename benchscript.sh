@@ -0,0 +1,2 @@
+g++ -O2 bench_reply.cpp -o bench_reply
+./bench_reply
\ No newline at end of file
@@ -1,2 +1,2 @@
-g++ ftp.cpp -o ftp
+g++ ftp.cpp -o ftp -pthread
 ./ftp ftp.tripod.com
\ No newline at end of file
@@ -15,6 +15,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include "ftpreply.h"
 
 using namespace std;
 
@@ -25,6 +27,7 @@ using namespace std;
  *  open, cd subdir, ls, get file, put file, close, quit.
  *  
  *  To run: ./ftp ftp.tripod.com [OR] ./buildscript.sh
+ *  Add --quiet to turn off the transfer progress display.
  *  Username: css432
  *  Password: *******
  * 
@@ -34,6 +37,14 @@ using namespace std;
  *      - ls          : lists all the files in the current directory  
  *      - get file    : gets the specified file from the server
  *      - put         : prompts to enter filename and puts the file onto the server
+ *      - meta [dir]  : prefetches size and modification time of every file in the directory
+ *      - queue get remote... / queue put local [remote] : adds transfers to the queue
+ *      - queue       : shows the transfer queue
+ *      - run         : runs every unfinished transfer in the queue, resuming partial ones
+ *      - dedup       : shows how many uploads were skipped because the server had the content
+ *      - fxp file host [port] [remotefile] : copies file from this server straight to another one
+ *      - active      : data connections are made by the server (PORT/EPRT)
+ *      - passive     : data connections are made by the client (PASV), the default
  *      - close       : closes the connection to the server, but does not exit program
  *      - quit        : closes connection if still active and exits the programs
  * 
@@ -55,6 +66,55 @@ void put();
 bool verifyFile(string& file);
 void setTypeI();
 void get(vector<string> inputArray);
+bool putFile(string localFileName, string remoteFileName, long long offset);
+bool getFile(string remoteFileName, string localFileName, long long offset);
+template<bool TrackProgress> long long transferLoop(int srcFD, int dstFD);
+void tuneUpdate(struct TransferTuner& tuner);
+double now();
+int readReply(string& reply);
+int readReplyFrom(int sd, string& pending, string& reply);
+void sendCommand(string command);
+void sendCommandTo(int sd, string command);
+void meta(vector<string> inputArray);
+bool prefetchMLSD(string dir);
+bool prefetchPipelined(string dir);
+time_t parseMDTM(string value);
+const struct FileMeta* findMeta(string name);
+void progressStart(string name, long long expected);
+void progressStop();
+void progressRender(bool final);
+string formatBytes(double bytes);
+string progressBar(long long done, long long total, int width);
+string formatEta(double seconds);
+void transferLog(string text);
+void queueLoad();
+void queueAppend(string record, bool sync);
+int queueAdd(string op, string local, string remote);
+void queueCommand(vector<string> inputArray);
+void runQueue();
+bool runEntry(int id);
+void queueCheckpoint(long long transferred);
+string queueKey(const struct QueueEntry& entry);
+string remotePath(string name);
+string remoteDir();
+bool hashFile(string name, struct ContentHash& hash);
+void dedupLoad();
+string dedupKey(const struct ContentHash& hash, string server);
+void dedupRecord(const struct ContentHash& hash, string remote);
+bool dedupAdd(string key, string server, string path);
+void dedupRemove(string key, string server, string path);
+bool dedupPut(const struct ContentHash& hash, string remote);
+long long remoteSize(string remote);
+void dedupStats();
+void fxp(vector<string> inputArray);
+int fxpConnect(string name, int port, string& pending);
+int fxpCommand(int sd, string& pending, string command, string label);
+bool dataConnect();
+bool dataAccept();
+bool port();
+bool listenerPoolFill();
+void listenerRetire();
+void listenerPoolClose();
 
 // Data
 const int BUFF_SIZE = 8192;
@@ -63,8 +123,141 @@ char* hostname;                 // To record the servername from command-line ar
 bool isLoggedIn = false;        // To keep track if user is logged in or not
 int clientSD;                   // To keep track of client socket
 struct hostent *host;
-int passiveSD;                  // To keep track of server socket in pasv()
+int passiveSD;                  // Data connection, from pasv() or dataAccept() in active mode
 int pid;                        // For fork in pasv()
+bool transferRefused = false;   // Last getFile()/putFile() got a 5xx reply, retrying won't help
+
+// Data transfer autotuning
+const size_t MIN_CHUNK = 8192;              // Smallest I/O size used by transferLoop()
+const size_t MAX_CHUNK = 4 * 1024 * 1024;   // Largest I/O size used by transferLoop()
+const int MIN_DEPTH = 2;                    // Fewest chunks kept in flight in the socket buffer
+const int MAX_DEPTH = 16;                   // Most chunks kept in flight in the socket buffer
+const double TUNE_WINDOW = 0.1;             // Seconds between autotune decisions
+
+struct TransferTuner
+{
+    size_t chunkSize;           // Current I/O size
+    int depth;                  // Chunks that should be in flight, advice unless the buffer is set
+    int socketFD;               // Data connection being tuned
+    int bufferOption;           // SO_RCVBUF when receiving, SO_SNDBUF when sending
+    long long windowBytes;      // Bytes moved in the current window
+    double windowStart;         // When the current window started
+    double socketTime;          // Seconds blocked on the socket in the current window
+    double fileTime;            // Seconds blocked on the file in the current window
+    int chunks;                 // Reads in the current window
+    int fullChunks;             // Reads in the current window that filled the chunk
+    double lastRate;            // Bytes per second of the previous window
+};
+
+// Remote file metadata
+const int PIPELINE_DEPTH = 64;              // SIZE/MDTM commands sent before reading replies
+
+struct FileMeta
+{
+    string name;                // Path relative to the current remote directory
+    long long size;             // Size in bytes
+    time_t mtime;               // Modification time (UTC), 0 if unknown
+};
+
+vector<FileMeta> metaIndex;     // Filled by meta(), sorted by name
+string metaBase;                // Absolute remote directory the names are relative to
+string controlPending;          // Control data read past the end of the last reply
+
+// Progress reporting
+const int PROGRESS_REFRESH_MS = 250;        // How often the progress line is redrawn
+const int PROGRESS_BAR_WIDTH = 30;          // Characters in the progress bar
+const int BATCH_BAR_WIDTH = 20;             // Characters in the bar for the whole 'run'
+
+// Lives in memory shared with the forked transfer process,
+// so the counters have to be lock-free to work across processes
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "progress counters must be lock-free");
+struct Progress
+{
+    atomic<long long> bytes;    // Bytes moved so far, updated by transferLoop()
+    atomic<long long> expected; // Size of the file, -1 if unknown
+    atomic<int> reply;          // Final reply the transfer process read, 0 if it read none
+};
+
+Progress* progress;             // Counters of the running transfer
+bool quiet = false;             // Set by --quiet, skips progress entirely
+thread progressThread;          // Redraws the progress line while a transfer runs
+atomic<bool> progressRunning;   // Tells progressThread to stop
+string progressName;            // File being transferred
+double progressStartTime;       // When the running transfer started
+double progressLastTime;        // When the line was last drawn
+long long progressLastBytes;    // Bytes at the last draw
+double progressRate;            // Smoothed instantaneous rate (bytes/sec)
+long long sessionBytes = 0;     // Bytes moved by finished transfers this session
+double sessionTime = 0;         // Seconds spent in finished transfers this session
+long long batchTotal = -1;      // Bytes 'run' is going to move, -1 outside 'run' or if unknown
+long long batchDone = 0;        // Bytes of the transfers 'run' has finished with
+double batchStartTime;          // When 'run' started
+
+// Transfer queue
+const char QUEUE_FILE[] = ".ftpqueue";      // Append-only journal in the local directory
+const long long CHECKPOINT_BYTES = 16 * 1024 * 1024;    // Bytes between offset records
+
+// Journal records, one per line, tab separated:
+//   E id op host local remote      enqueued
+//   S id offset                    started (in flight) at offset
+//   O id offset                    checkpoint, offset bytes transferred
+//   D id offset                    done, offset is the final size
+//   F id offset                    failed, the server refused the transfer
+struct QueueEntry
+{
+    char state;                 // 'E' enqueued, 'S' in flight, 'D' done, 'F' failed
+    string op;                  // "get" or "put"
+    string host;                // Server the transfer belongs to
+    string local;               // Local file
+    string remote;              // Absolute remote path
+    long long offset;           // Bytes known to be transferred
+};
+
+vector<QueueEntry> queueEntries;    // Indexed by id, rebuilt from the journal at startup
+set<string> queueDone;              // queueKey() of every done entry, so re-queueing is a lookup
+int queueFD = -1;                   // Journal, opened with O_APPEND
+int queueActive = -1;               // Entry being transferred, for checkpoints
+long long queueBase = 0;            // Offset the active transfer started at
+long long queueCheckpointed = 0;    // Offset of the last checkpoint written
+
+// Upload deduplication
+const char DEDUP_FILE[] = ".ftpdedup";      // Content hash index in the local directory
+
+// Records in DEDUP_FILE are this header followed by the
+// host and remote path
+struct DedupRecord
+{
+    uint64_t h1;                // Content hash, first half
+    uint64_t h2;                // Content hash, second half
+    int64_t size;               // Size of the content in bytes
+    uint16_t hostLength;        // Bytes of host that follow
+    uint16_t pathLength;        // Bytes of path that follow the host
+} __attribute__((packed));
+
+struct ContentHash
+{
+    uint64_t h1;                // MurmurHash3 x64 128-bit of the file
+    uint64_t h2;
+    long long size;             // Size of the file in bytes
+};
+
+unordered_map<string, vector<string>> dedupIndex;  // dedupKey() to remote paths with that content
+unordered_map<string, string> dedupPaths;           // Host and path to the dedupKey() stored there
+int dedupFD = -1;                   // DEDUP_FILE, opened with O_APPEND
+bool siteCopySupported = true;      // Cleared when the server doesn't implement SITE CPFR
+int dedupChecked = 0;               // Uploads looked up this session
+int dedupSkipped = 0;               // Already on the server at the same path
+int dedupCopied = 0;                // Copied on the server with SITE CPFR/CPTO
+long long dedupBytesSaved = 0;      // Bytes not sent thanks to the above
+
+// Active mode
+const int LISTENER_POOL_SIZE = 8;           // Listeners kept ready, each used for one transfer only
+const int ACCEPT_TIMEOUT_MS = 10000;        // How long to wait for the server to connect
+
+bool activeMode = false;            // Set by 'active', cleared by 'passive'
+bool eprtSupported = true;          // Cleared when the server rejects EPRT
+deque<int> listenerPool;            // Bound and listening sockets on fresh ports, oldest first
+int activeListener = -1;            // Listener the server was told to connect to
 
 /**
  *  main(int argc, char* argv[])
@@ -76,18 +269,43 @@ int pid;                        // For fork in pasv()
  */
 int main(int argc, char* argv[])
 {
+    // Counters the transfer process updates for the progress display
+    progress = (Progress*)mmap(NULL, sizeof(Progress), PROT_READ | PROT_WRITE, 
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    new (progress) Progress();
+    progress->bytes.store(0);
+    progress->expected.store(-1);
+    progress->reply.store(0);
+
+    // Pick up transfers left over from the last run
+    queueLoad();
+    dedupLoad();
+
     // Check arguments
-    // If two arguments are given then hostname is second
-    if(argc == 2)
+    // The hostname is the first argument that is not an option
+    char* hostArgument = NULL;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--quiet") == 0)
+        {
+            quiet = true;
+        }
+        else
+        {
+            hostArgument = argv[i];
+        }
+    }
+
+    if(hostArgument != NULL)
     {
-        hostname = argv[1];             // Store hostname
+        hostname = hostArgument;        // Store hostname
         open(21);                       // Call open with default port 21
     } 
     // Run client but do not connect to server
     else
     {
         // Store value of server in hostname
-        char tripod[] = "ftp.tripod.com";
+        static char tripod[] = "ftp.tripod.com";
         hostname = tripod;
     }
 
@@ -141,9 +359,11 @@ int main(int argc, char* argv[])
         {
             if(isLoggedIn)
             {
-                pasv();
-                // cout << "Completed Passive Connection" << endl;
-                ls();
+                if(dataConnect())
+                {
+                    // cout << "Completed Passive Connection" << endl;
+                    ls();
+                }
             }
             else
             {
@@ -172,6 +392,52 @@ int main(int argc, char* argv[])
                 cout << "Not connected to server." << endl;
             }
         }
+        else if(command == "meta")
+        {
+            if(isLoggedIn)
+            {
+                meta(inputArray);
+            }
+            else
+            {
+                cout << "Not connected to server." << endl;
+            }
+        }
+        else if(command == "queue")
+        {
+            queueCommand(inputArray);
+        }
+        else if(command == "run")
+        {
+            if(isLoggedIn)
+            {
+                runQueue();
+            }
+            else
+            {
+                cout << "Not connected to server." << endl;
+            }
+        }
+        else if(command == "dedup")
+        {
+            dedupStats();
+        }
+        else if(command == "fxp")
+        {
+            if(isLoggedIn)
+            {
+                fxp(inputArray);
+            }
+            else
+            {
+                cout << "Not connected to server." << endl;
+            }
+        }
+        else if(command == "active" || command == "passive")
+        {
+            activeMode = (command == "active");
+            cout << "Data connections are now " << command << "." << endl;
+        }
         else if(command == "close")
         {
             // If logged in 
@@ -248,7 +514,7 @@ void serverResponse()
 {
     bzero(buffer, sizeof(buffer));          // Zero out buffer before communication
 
-    read(clientSD, buffer, sizeof(buffer)); // Read the response into buffer
+    read(clientSD, buffer, sizeof(buffer) - 1); // Read the response into buffer, keeping the null
 }
 
 /**
@@ -381,10 +647,8 @@ void passwordVerification()
         serverResponse();
         cout << buffer;
 
-        string errorCode = "501";                   // Error code for bad password
-
-        // If response is not incorrect password error
-        if(!strstr(buffer, errorCode.c_str()))      
+        // If response is not an error (501 bad password, 530 not logged in)
+        if(lastReplyCode(buffer, strlen(buffer)) < 400)
         {
             // Break, because correct password was entered
             break;                                  
@@ -414,6 +678,12 @@ void close()
 
     // Shutdown socket
     shutdown(clientSD, SHUT_WR);            
+
+    // The next session may be on another interface
+    listenerPoolClose();
+
+    // Or another server
+    siteCopySupported = true;
 }
 
 /**
@@ -449,6 +719,12 @@ void ls()
     // Child Process
     else
     {
+        // In active mode the server connects to us once it has the command
+        if(!dataAccept())
+        {
+            exit(1);
+        }
+
         // Zero out the buffer
         bzero(buffer, sizeof(buffer));
 
@@ -497,15 +773,17 @@ bool pasv()
     serverResponse();
     cout << buffer;
 
-    int x, y, z, a, x1, y2;         // For response in pasv()
-
-    // Record response values 
-    sscanf(buffer, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)", &x, &y, &z, &a, &x1, &y2);
-
     // Find port the server is listening on
-    int port = (x1 * 256) + y2;
+    uint32_t address;
+    uint16_t port;
+    if(!parsePasv(buffer, strlen(buffer), &address, &port))
+    {
+        cout << "Server did not enter passive mode." << endl;
+        return false;
+    }
 
-    // Connect to server using port
+    // Connect to server using port. The address in the reply is not used,
+    // servers behind NAT often send their private one
     struct sockaddr_in socketAddress;
     bzero((char *)&socketAddress, sizeof(socketAddress));
     socketAddress.sin_family = AF_INET;
@@ -559,6 +837,9 @@ void cd(vector<string> inputArray)
 
     // Send command and subdir to server
     write(clientSD, (char*)&command, strlen(command));
+
+    // Names in the index are relative to the old directory
+    metaIndex.clear();
     
     // Get and print server response
     // serverResponse();
@@ -598,22 +879,50 @@ void put()
         return;
     }
 
+    // Journal the transfer so it can be resumed if we die
+    runEntry(queueAdd("put", localFileName, remotePath(remoteFileName)));
+}
+
+/**
+ *  putFile(string localFileName, string remoteFileName, long long offset)
+ * 
+ *  Transfers a local file to the server, starting
+ *  offset bytes into it.
+ * 
+ *  @param localFileName File to send
+ *  @param remoteFileName Name to store it as on the server
+ *  @param offset Bytes the server already has, 0 for a new upload
+ *  @return bool representing if the whole file was sent and the server confirmed it
+ */
+bool putFile(string localFileName, string remoteFileName, long long offset)
+{
+    transferRefused = false;
     setTypeI();                     // Set data type to 'I' (binary)
 
-    // Establish a passive connection to server
-    if(!pasv())
+    // Establish a data connection to server
+    if(!dataConnect())
+    {
+        return false;               // If connection fails, return
+    }
+
+    // Ask the server to continue where the last upload stopped
+    if(offset > 0)
     {
-        return;                     // If connection fails, return
+        sendCommand("REST " + to_string(offset));
+        serverResponse();
+        cout << buffer;
     }
 
     // Fork a process so the child can write to server
     pid = fork();
 
+    int status = 1;
+
     // Error
     if(pid < 0)
     {
         cout << "Fork failed." << endl;
-        return;
+        return false;
     }
     // Parent process
     else if(pid > 0)
@@ -627,8 +936,12 @@ void put()
         // Write command to server
         write(clientSD, (char*)&command, strlen(command));
         
-        // Wait for child process to finish
-        wait(NULL);
+        // Show progress while waiting for child process to finish
+        struct stat localStat;
+        stat(localFileName.c_str(), &localStat);
+        progressStart(localFileName, localStat.st_size - offset);
+        wait(&status);
+        progressStop();
     }
     // Child process
     else
@@ -655,40 +968,47 @@ void put()
         file.close();
         */
 
+        // In active mode the server connects to us once it has STOR
+        if(!dataAccept())
+        {
+            exit(1);
+        }
+
         // Refactored to include O_RDONLY
 
         // Open file with O_RDONLY option
         int file = open(localFileName.c_str(), O_RDONLY);
+        lseek(file, offset, SEEK_SET);
 
-        while(true)
-        {
-            // Record number of bytes read
-            int numRead = read(file, buffer, sizeof(buffer));
-
-            // If no bytes are read, exit loop
-            if(numRead == 0)
-            {
-                break;
-            }
-            
-            // Write bytes read to server
-            write(passiveSD, buffer, numRead);
-        }
+        // Send the file to the server
+        long long sent = quiet ? transferLoop<false>(file, passiveSD) 
+                               : transferLoop<true>(file, passiveSD);
 
         close(file);
-        exit(0);
+        exit(sent < 0 ? 1 : 0);
     }  
 
     close(passiveSD);               // Close passive connection
 
     // Poll the socket
+    int finalCode = 0;
     while(poll() > 0)
     {
         // While poll return > 0
         // Get response and print it
         serverResponse();
         cout << buffer;
+
+        int code = lastReplyCode(buffer, strlen(buffer));
+        if(code >= 200)
+        {
+            finalCode = code;
+        }
     }
+
+    // Only the server knows if it stored everything, e.g. 553 not allowed or 426 aborted
+    transferRefused = finalCode >= 500;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && (finalCode == 226 || finalCode == 250);
 } 
 
 /**
@@ -751,22 +1071,52 @@ void get(vector<string> inputArray)
         return;
     }
 
+    // Journal the transfer so it can be resumed if we die
+    // inputArray[1] holds the filename from command line argument
+    runEntry(queueAdd("get", inputArray[1], remotePath(inputArray[1])));
+}
+
+/**
+ *  getFile(string remoteFileName, string localFileName, long long offset)
+ * 
+ *  Gets a file from the server, starting offset bytes
+ *  into it, and writes it to a local file.
+ * 
+ *  @param remoteFileName File to fetch
+ *  @param localFileName Where to store it
+ *  @param offset Bytes of the local file already received, 0 for a new download
+ *  @return bool representing if the whole file was received and the server confirmed it
+ */ 
+bool getFile(string remoteFileName, string localFileName, long long offset)
+{
+    transferRefused = false;
     setTypeI();                     // Set data type to 'I' (binary)
 
-    // Esatblish a passive connection to server
-    if(!pasv())
+    // Esatblish a data connection to server
+    if(!dataConnect())
     {
-        return;
+        return false;
+    }
+
+    // Ask the server to continue where the last download stopped
+    if(offset > 0)
+    {
+        sendCommand("REST " + to_string(offset));
+        serverResponse();
+        cout << buffer;
     }
 
     // Fork so child process can read from server
     pid = fork();   
 
+    int status = 1;
+    int finalCode = 0;              // Final reply to RETR, the child may read it first
+
     // Error
     if(pid < 0)
     {
         cout << "Fork failed." << endl;
-        return;
+        return false;
     }
     // Parent process
     else if(pid > 0)
@@ -774,15 +1124,18 @@ void get(vector<string> inputArray)
         // Prepare command 
         char command[BUFF_SIZE];
         strcpy(command, "RETR ");
-        // inputArray[1] holds the filename from command line argument
-        strcat(command, inputArray[1].c_str());
+        strcat(command, remoteFileName.c_str());
         strcat(command, "\r\n");
 
         // Write command to server
         write(clientSD, (char*)&command, strlen(command));
 
-        // Wait for child process
-        wait(NULL);
+        // Show progress while waiting for child process
+        const FileMeta* fileMeta = findMeta(remoteFileName);
+        progressStart(localFileName, fileMeta != NULL ? fileMeta->size - offset : -1);
+        wait(&status);
+        finalCode = progress->reply.load();
+        progressStop();
     }
     // Child process
     else
@@ -792,42 +1145,63 @@ void get(vector<string> inputArray)
         {
             // Get and print response
             serverResponse();
-            cout << buffer;
+            transferLog(buffer);
+
+            // The server may tell us the size, "150 ... (1234 bytes)"
+            long long size;
+            const char* sizeText = strrchr(buffer, '(');
+            if(sizeText != NULL && sscanf(sizeText, "(%lld bytes)", &size) == 1 
+               && progress->expected.load() < 0)
+            {
+                progress->expected.store(size - offset);
+            }
 
-            string error = "550";
+            // A small file may be done before the server goes quiet
+            int code = lastReplyCode(buffer, strlen(buffer));
+            if(code >= 200)
+            {
+                progress->reply.store(code);
+            }
 
-            if(strstr(buffer, error.c_str()))
+            // RETR failed, exit 2 if it was refused for good, e.g. 550 no such file
+            if(code >= 400)
             {
-                exit(0);
-                return;
+                exit(code >= 500 ? 2 : 1);
             }
         }
 
-        // Open a file
-        int file = open(inputArray[1].c_str(), O_WRONLY | O_CREAT, 
-                                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        // In active mode the server has connected to the listener by now
+        if(!dataAccept())
+        {
+            exit(1);
+        }
 
-        // Zero out buffer
-        bzero(buffer, sizeof(buffer));
+        // Open a file, keeping what was already received when resuming
+        int flags = O_WRONLY | O_CREAT | (offset > 0 ? 0 : O_TRUNC);
+        int file = open(localFileName.c_str(), flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        lseek(file, offset, SEEK_SET);
 
-        // While there is more data to be read
-        while(true)
+        // Reserve the space up front if meta has the size. KEEP_SIZE leaves
+        // the file size at what has really been written, which resume relies on
+        const FileMeta* fileMeta = findMeta(remoteFileName);
+        if(fileMeta != NULL && fileMeta->size > offset)
         {
-            // Read into buffer and record number of bytes read
-            int numRead = read(passiveSD, buffer, sizeof(buffer));
+            transferLog("Expecting " + to_string(fileMeta->size) + " bytes.");
+            fallocate(file, FALLOC_FL_KEEP_SIZE, offset, fileMeta->size - offset);
+        }
 
-            // If there was no bytes read, break the loop, eof
-            if(numRead == 0)
-            {
-                break;
-            }
+        // Receive the file from the server
+        long long received = quiet ? transferLoop<false>(passiveSD, file) 
+                                   : transferLoop<true>(passiveSD, file);
 
-            // Write buffer to local file
-            write(file, buffer, numRead);
-        }                   
+        // Drop any preallocated space the transfer did not fill
+        if(received >= 0)
+        {
+            ftruncate(file, offset + received);
+        }
 
         close(file);
-        exit(0); 
+        exit(received < 0 ? 1 : 0); 
     }
     close(passiveSD);
 
@@ -838,5 +1212,2237 @@ void get(vector<string> inputArray)
         // Get response and print it
         serverResponse();
         cout << buffer;
+
+        int code = lastReplyCode(buffer, strlen(buffer));
+        if(code >= 200)
+        {
+            finalCode = code;
+        }
+    }
+
+    // A closed data connection isn't a finished file, e.g. 426 after a dropped transfer
+    transferRefused = (WIFEXITED(status) && WEXITSTATUS(status) == 2) || finalCode >= 500;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && (finalCode == 226 || finalCode == 250);
+}
+
+/**
+ *  transferLoop<TrackProgress>(int srcFD, int dstFD)
+ * 
+ *  Copies everything from srcFD to dstFD until end of file.
+ *  One side is the data connection (passiveSD), the other is
+ *  the local file. The time spent blocked on each side is
+ *  measured so tuneUpdate() can resize the chunk as it goes.
+ *  With TrackProgress false (--quiet) the progress counter
+ *  update is not compiled into the loop at all.
+ * 
+ *  @param srcFD Descriptor to read from
+ *  @param dstFD Descriptor to write to
+ *  @return the number of bytes transferred, or -1 on error
+ */
+template<bool TrackProgress>
+long long transferLoop(int srcFD, int dstFD)
+{
+    TransferTuner tuner;
+    tuner.chunkSize = MIN_CHUNK;
+    tuner.depth = MIN_DEPTH;
+    tuner.socketFD = passiveSD;
+    tuner.bufferOption = (srcFD == passiveSD) ? SO_RCVBUF : SO_SNDBUF;
+    tuner.windowBytes = 0;
+    tuner.windowStart = now();
+    tuner.socketTime = 0;
+    tuner.fileTime = 0;
+    tuner.chunks = 0;
+    tuner.fullChunks = 0;
+    tuner.lastRate = 0;
+
+    vector<char> data(tuner.chunkSize);
+    long long total = 0;
+
+    while(true)
+    {
+        // Grow the buffer if the tuner asked for a bigger chunk
+        if(data.size() < tuner.chunkSize)
+        {
+            data.resize(tuner.chunkSize);
+        }
+
+        double start = now();
+
+        // Record number of bytes read
+        ssize_t numRead = read(srcFD, data.data(), tuner.chunkSize);
+
+        if(numRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        // If no bytes are read, eof (or error), exit loop
+        if(numRead <= 0)
+        {
+            return numRead < 0 ? -1 : total;
+        }
+
+        double readDone = now();
+
+        // Write everything that was read, the socket may take less
+        ssize_t written = 0;
+        while(written < numRead)
+        {
+            ssize_t numWritten = write(dstFD, data.data() + written, numRead - written);
+            if(numWritten < 0)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            written += numWritten;
+        }
+
+        double writeDone = now();
+
+        // Charge the time to whichever side it was spent on
+        bool fromSocket = (tuner.bufferOption == SO_RCVBUF);
+        tuner.socketTime += fromSocket ? readDone - start : writeDone - readDone;
+        tuner.fileTime += fromSocket ? writeDone - readDone : readDone - start;
+
+        tuner.chunks++;
+        if((size_t)numRead == tuner.chunkSize)
+        {
+            tuner.fullChunks++;
+        }
+        tuner.windowBytes += numRead;
+        total += numRead;
+
+        if(TrackProgress)
+        {
+            progress->bytes.fetch_add(numRead, memory_order_relaxed);
+        }
+
+        if(writeDone - tuner.windowStart >= TUNE_WINDOW)
+        {
+            tuneUpdate(tuner);
+            queueCheckpoint(total);
+        }
+    }
+}
+
+/**
+ *  tuneUpdate(TransferTuner& tuner)
+ * 
+ *  Called once per window by transferLoop(). Compares the
+ *  window's throughput and stall times with the previous one,
+ *  grows or shrinks the chunk, works out how many chunks should
+ *  be in flight from TCP_INFO (RTT, cwnd) and logs any change it
+ *  makes. The socket buffer is normally left to the kernel.
+ * 
+ *  @param tuner State of the running transfer
+ */
+void tuneUpdate(TransferTuner& tuner)
+{
+    double elapsed = now() - tuner.windowStart;
+    double rate = tuner.windowBytes / elapsed;
+    size_t oldChunk = tuner.chunkSize;
+    int oldDepth = tuner.depth;
+    string reason;
+
+    bool fileBound = tuner.fileTime > 2 * tuner.socketTime;
+    bool chunksFull = tuner.fullChunks * 2 >= tuner.chunks;
+
+    if(fileBound)
+    {
+        // Local disk is the bottleneck. Copying into the page cache costs the
+        // same per byte whatever the chunk, so never shrink here, and bigger
+        // chunks at least save syscalls. Rate swings are the disk's, not ours
+        if(chunksFull && tuner.chunkSize < MAX_CHUNK)
+        {
+            tuner.chunkSize *= 2;
+            reason = "file bound, fewer syscalls";
+        }
+    }
+    else if(rate < tuner.lastRate * 0.7 && tuner.chunkSize > MIN_CHUNK)
+    {
+        // Last change made things worse, back off
+        tuner.chunkSize /= 2;
+        reason = "rate dropped";
+    }
+    else if(chunksFull && rate >= tuner.lastRate * 0.9 && tuner.chunkSize < MAX_CHUNK)
+    {
+        // Data is waiting on every read, take more of it at once
+        tuner.chunkSize *= 2;
+        reason = "chunks full";
+    }
+
+    // Ask the kernel how the connection is doing. When receiving, the send
+    // side numbers are our own (idle) direction, so use the receiver's view
+    struct tcp_info info;
+    socklen_t infoLen = sizeof(info);
+    bool receiving = (tuner.bufferOption == SO_RCVBUF);
+    double rtt = 0;
+    double window = 0;
+    if(getsockopt(tuner.socketFD, IPPROTO_TCP, TCP_INFO, &info, &infoLen) == 0)
+    {
+        if(receiving)
+        {
+            rtt = info.tcpi_rcv_rtt / 1e6;
+            window = info.tcpi_rcv_space;
+        }
+        else
+        {
+            rtt = info.tcpi_rtt / 1e6;
+            window = (double)info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+        }
+
+        // Keep about two bandwidth-delay products in flight
+        double bdp = max(window, rate * rtt);
+        int depth = (int)ceil(2 * bdp / tuner.chunkSize);
+        tuner.depth = min(max(depth, MIN_DEPTH), MAX_DEPTH);
+    }
+
+    if(tuner.chunkSize != oldChunk || tuner.depth != oldDepth)
+    {
+        // Setting the buffer locks it at that size for good, turning off the
+        // kernel's own autotuning, which grows it up to the last tcp_rmem or
+        // tcp_wmem value. So depth is only advice to the kernel, and the buffer
+        // is set only when the target is past what autotuning can reach but
+        // within rmem_max/wmem_max, the most setsockopt() will allow
+        long long wanted = (long long)tuner.chunkSize * tuner.depth;
+
+        long long minimum = 0;
+        long long initial = 0;
+        long long ceiling = 0;
+        ifstream limitsFile(receiving ? "/proc/sys/net/ipv4/tcp_rmem" : "/proc/sys/net/ipv4/tcp_wmem");
+        limitsFile >> minimum >> initial >> ceiling;
+
+        long long cap = 0;
+        ifstream capFile(receiving ? "/proc/sys/net/core/rmem_max" : "/proc/sys/net/core/wmem_max");
+        capFile >> cap;
+
+        bool setBuffer = ceiling > 0 && wanted > ceiling && wanted <= cap;
+        if(setBuffer)
+        {
+            int size = (int)wanted;
+            setsockopt(tuner.socketFD, SOL_SOCKET, tuner.bufferOption, &size, sizeof(size));
+        }
+
+        ostringstream log;
+        log << fixed << setprecision(1);
+        log << "Autotune: chunk " << oldChunk / 1024 << " KB -> " << tuner.chunkSize / 1024 
+            << " KB, depth " << oldDepth << " -> " << tuner.depth
+            << " (" << (reason.empty() ? "tcp info" : reason) << ", " 
+            << rate / (1024 * 1024) << " MB/s, socket " << tuner.socketTime * 1000 
+            << " ms, file " << tuner.fileTime * 1000 << " ms, rtt " << rtt * 1000 
+            << " ms, " << (receiving ? "rcv space " : "cwnd ") << (long long)window / 1024 << " KB)"
+            << (setBuffer ? ", buffer set to " + to_string(wanted / 1024) + " KB" : "");
+        transferLog(log.str());
+    }
+
+    // Start a new window
+    tuner.lastRate = rate;
+    tuner.windowBytes = 0;
+    tuner.windowStart = now();
+    tuner.socketTime = 0;
+    tuner.fileTime = 0;
+    tuner.chunks = 0;
+    tuner.fullChunks = 0;
+}
+
+/**
+ *  now()
+ * 
+ *  @return seconds on the monotonic clock
+ */
+double now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ *  readReply(string& reply)
+ * 
+ *  Reads one complete reply from the control connection,
+ *  including every line of a multi-line reply. Anything
+ *  read past the end of the reply is kept in controlPending
+ *  for the next call.
+ * 
+ *  @param reply Set to the full text of the reply
+ *  @return the three digit reply code, or -1 if the connection closed
+ */
+int readReply(string& reply)
+{
+    return readReplyFrom(clientSD, controlPending, reply);
+}
+
+/**
+ *  readReplyFrom(int sd, string& pending, string& reply)
+ * 
+ *  readReply() for any control connection.
+ * 
+ *  @param sd Control connection
+ *  @param pending Data read past the last reply on this connection
+ *  @param reply Set to the full text of the reply
+ *  @return the three digit reply code, or -1 if the connection closed
+ */
+int readReplyFrom(int sd, string& pending, string& reply)
+{
+    while(true)
+    {
+        // Look for a complete reply in what has been read so far
+        int code;
+        size_t used;
+        while((used = parseReply(pending.data(), pending.size(), &code)) > 0)
+        {
+            reply.assign(pending, 0, used);
+            pending.erase(0, used);
+
+            // Skip stray lines that are not replies
+            if(code > 0)
+            {
+                return code;
+            }
+        }
+
+        // Need more data from the server
+        char data[BUFF_SIZE];
+        ssize_t numRead = read(sd, data, sizeof(data));
+        if(numRead <= 0)
+        {
+            return -1;
+        }
+        pending.append(data, numRead);
+    }
+}
+
+/**
+ *  sendCommand(string command)
+ * 
+ *  Sends a command, terminated with CRLF, on the
+ *  control connection.
+ * 
+ *  @param command Command and its arguments
+ */
+void sendCommand(string command)
+{
+    sendCommandTo(clientSD, command);
+}
+
+/**
+ *  sendCommandTo(int sd, string command)
+ * 
+ *  sendCommand() for any control connection.
+ * 
+ *  @param sd Control connection
+ *  @param command Command and its arguments
+ */
+void sendCommandTo(int sd, string command)
+{
+    command += "\r\n";
+    write(sd, command.c_str(), command.size());
+}
+
+/**
+ *  meta(vector<string> inputArray)
+ * 
+ *  Fetches the size and modification time of every file in
+ *  a remote directory into metaIndex. Uses a single MLSD
+ *  listing when the server has it, otherwise lists names
+ *  with NLST and pipelines SIZE/MDTM for each of them.
+ * 
+ *  @param inputArray Vector of command line arguments
+ */
+void meta(vector<string> inputArray)
+{
+    // inputArray always ends with an empty word from splitInput()
+    string dir = inputArray.size() > 2 ? inputArray[1] : "";
+
+    metaIndex.clear();
+    metaBase = remoteDir();
+
+    if(!prefetchMLSD(dir) && !prefetchPipelined(dir))
+    {
+        cout << "Could not fetch file information." << endl;
+        return;
+    }
+
+    sort(metaIndex.begin(), metaIndex.end(), 
+         [](const FileMeta& a, const FileMeta& b) { return a.name < b.name; });
+
+    // Show largest first, that is the order worth transferring in
+    vector<const FileMeta*> bySize;
+    long long total = 0;
+    for(const FileMeta& entry : metaIndex)
+    {
+        bySize.push_back(&entry);
+        total += entry.size;
+    }
+    sort(bySize.begin(), bySize.end(), 
+         [](const FileMeta* a, const FileMeta* b) { return a->size > b->size; });
+
+    for(const FileMeta* entry : bySize)
+    {
+        char when[32] = "-";
+        if(entry->mtime != 0)
+        {
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&entry->mtime));
+        }
+        cout << setw(14) << entry->size << "  " << when << "  " << entry->name << endl;
+    }
+    cout << metaIndex.size() << " files, " << total << " bytes." << endl;
+}
+
+/**
+ *  prefetchMLSD(string dir)
+ * 
+ *  Fills metaIndex from one MLSD listing of dir.
+ * 
+ *  @param dir Remote directory, empty for the current one
+ *  @return bool representing if the server supported MLSD
+ */
+bool prefetchMLSD(string dir)
+{
+    if(!dataConnect())
+    {
+        return false;
+    }
+
+    sendCommand(dir.empty() ? "MLSD" : "MLSD " + dir);
+
+    string reply;
+    int code = readReply(reply);
+    cout << reply;
+    if(code < 100 || code >= 200 || !dataAccept())
+    {
+        close(passiveSD);
+        return false;
+    }
+
+    // Read the whole listing
+    string listing;
+    char data[BUFF_SIZE];
+    ssize_t numRead;
+    while((numRead = read(passiveSD, data, sizeof(data))) > 0)
+    {
+        listing.append(data, numRead);
+    }
+    close(passiveSD);
+
+    code = readReply(reply);
+    cout << reply;
+    if(code != 226 && code != 250)
+    {
+        return false;
+    }
+
+    // Each line is "fact=value;fact=value; name"
+    istringstream lines(listing);
+    string line;
+    while(getline(lines, line))
+    {
+        if(!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+
+        size_t space = line.find(' ');
+        if(space == string::npos)
+        {
+            continue;
+        }
+
+        FileMeta entry;
+        entry.name = dir.empty() ? line.substr(space + 1) : dir + "/" + line.substr(space + 1);
+        entry.size = -1;
+        entry.mtime = 0;
+        bool isFile = false;
+
+        istringstream facts(line.substr(0, space));
+        string fact;
+        while(getline(facts, fact, ';'))
+        {
+            size_t equals = fact.find('=');
+            if(equals == string::npos)
+            {
+                continue;
+            }
+            string key = fact.substr(0, equals);
+            string value = fact.substr(equals + 1);
+            transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+            if(key == "type")
+            {
+                transform(value.begin(), value.end(), value.begin(), ::tolower);
+                isFile = (value == "file");
+            }
+            else if(key == "size")
+            {
+                entry.size = atoll(value.c_str());
+            }
+            else if(key == "modify")
+            {
+                entry.mtime = parseMDTM(value);
+            }
+        }
+
+        if(isFile && entry.size >= 0)
+        {
+            metaIndex.push_back(entry);
+        }
+    }
+
+    return true;
+}
+
+/**
+ *  prefetchPipelined(string dir)
+ * 
+ *  Fills metaIndex for servers without MLSD. Lists the names
+ *  with NLST, then sends SIZE and MDTM for PIPELINE_DEPTH 
+ *  files at a time before reading their replies, so the
+ *  round-trips overlap. Names without a SIZE are directories
+ *  and are left out.
+ * 
+ *  @param dir Remote directory, empty for the current one
+ *  @return bool representing if the names could be listed
+ */
+bool prefetchPipelined(string dir)
+{
+    if(!dataConnect())
+    {
+        return false;
+    }
+
+    sendCommand(dir.empty() ? "NLST" : "NLST " + dir);
+
+    string reply;
+    int code = readReply(reply);
+    cout << reply;
+    if(code < 100 || code >= 200 || !dataAccept())
+    {
+        close(passiveSD);
+        return false;
+    }
+
+    string listing;
+    char data[BUFF_SIZE];
+    ssize_t numRead;
+    while((numRead = read(passiveSD, data, sizeof(data))) > 0)
+    {
+        listing.append(data, numRead);
+    }
+    close(passiveSD);
+
+    code = readReply(reply);
+    cout << reply;
+
+    vector<string> names;
+    istringstream lines(listing);
+    string line;
+    while(getline(lines, line))
+    {
+        if(!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if(line.empty())
+        {
+            continue;
+        }
+
+        // Some servers already prefix the directory
+        if(!dir.empty() && line.compare(0, dir.size() + 1, dir + "/") != 0)
+        {
+            line = dir + "/" + line;
+        }
+        names.push_back(line);
+    }
+
+    // SIZE needs binary mode to report the real size
+    setTypeI();
+
+    for(size_t first = 0; first < names.size(); first += PIPELINE_DEPTH)
+    {
+        size_t last = min(first + PIPELINE_DEPTH, names.size());
+
+        // Send the whole batch before reading anything back
+        string batch;
+        for(size_t i = first; i < last; i++)
+        {
+            batch += "SIZE " + names[i] + "\r\n";
+            batch += "MDTM " + names[i] + "\r\n";
+        }
+        write(clientSD, batch.c_str(), batch.size());
+
+        // Replies come back in the order the commands were sent
+        for(size_t i = first; i < last; i++)
+        {
+            FileMeta entry;
+            entry.name = names[i];
+            entry.size = -1;
+            entry.mtime = 0;
+
+            if(readReply(reply) == 213)
+            {
+                entry.size = atoll(reply.c_str() + 4);
+            }
+            if(readReply(reply) == 213)
+            {
+                entry.mtime = parseMDTM(reply.substr(4));
+            }
+
+            if(entry.size >= 0)
+            {
+                metaIndex.push_back(entry);
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ *  parseMDTM(string value)
+ * 
+ *  Converts an MDTM/MLSD timestamp (YYYYMMDDHHMMSS[.sss], UTC)
+ * 
+ *  @param value Timestamp as sent by the server
+ *  @return the time, or 0 if it could not be parsed
+ */
+time_t parseMDTM(string value)
+{
+    struct tm parts;
+    bzero(&parts, sizeof(parts));
+    if(sscanf(value.c_str(), "%4d%2d%2d%2d%2d%2d", &parts.tm_year, &parts.tm_mon, 
+              &parts.tm_mday, &parts.tm_hour, &parts.tm_min, &parts.tm_sec) != 6)
+    {
+        return 0;
+    }
+    parts.tm_year -= 1900;
+    parts.tm_mon -= 1;
+    return timegm(&parts);
+}
+
+/**
+ *  findMeta(string name)
+ * 
+ *  Looks up a file fetched by meta().
+ * 
+ *  @param name Path relative to the current remote directory, or absolute
+ *  @return the entry, or NULL if it is not in metaIndex
+ */
+const FileMeta* findMeta(string name)
+{
+    // Queued transfers use absolute paths
+    if(!name.empty() && name[0] == '/')
+    {
+        if(metaBase.empty() || name.compare(0, metaBase.size(), metaBase) != 0)
+        {
+            return NULL;
+        }
+        name = name.substr(metaBase.size());
+    }
+
+    auto found = lower_bound(metaIndex.begin(), metaIndex.end(), name, 
+                             [](const FileMeta& entry, const string& key) { return entry.name < key; });
+    if(found == metaIndex.end() || found->name != name)
+    {
+        return NULL;
+    }
+    return &*found;
+}
+
+
+/**
+ *  progressStart(string name, long long expected)
+ * 
+ *  Resets the shared counters and starts the thread that
+ *  redraws the progress line. Called by the parent right
+ *  after it forks the transfer process.
+ * 
+ *  @param name File being transferred
+ *  @param expected Size of the file, -1 if unknown
+ */
+void progressStart(string name, long long expected)
+{
+    progressName = name;
+    progressStartTime = now();
+    progressLastTime = progressStartTime;
+    progressLastBytes = 0;
+    progressRate = 0;
+
+    // Don't overwrite a size the child already found in the 150 reply
+    if(expected >= 0)
+    {
+        progress->expected.store(expected);
+    }
+
+    if(quiet)
+    {
+        return;
+    }
+
+    progressRunning = true;
+    progressThread = thread([]()
+    {
+        while(progressRunning)
+        {
+            this_thread::sleep_for(chrono::milliseconds(PROGRESS_REFRESH_MS));
+            progressRender(false);
+        }
+    });
+}
+
+/**
+ *  progressStop()
+ * 
+ *  Stops the redraw thread, draws the final line and adds
+ *  the transfer to the session totals. The counters are
+ *  reset for the next transfer.
+ */
+void progressStop()
+{
+    if(progressRunning)
+    {
+        progressRunning = false;
+        progressThread.join();
+        progressRender(true);
+        cout << endl;
+    }
+
+    sessionBytes += progress->bytes.load();
+    sessionTime += now() - progressStartTime;
+
+    progress->bytes.store(0);
+    progress->expected.store(-1);
+    progress->reply.store(0);
+}
+
+/**
+ *  progressRender(bool final)
+ * 
+ *  Draws one progress line for the running transfer: bar and
+ *  percentage when the size is known, instantaneous and average
+ *  rate, ETA, and either a bar and ETA for everything 'run' is
+ *  transferring or the bytes moved this session.
+ * 
+ *  @param final True once the transfer is over, only the average rate is shown
+ */
+void progressRender(bool final)
+{
+    double current = now();
+    long long bytes = progress->bytes.load(memory_order_relaxed);
+    long long expected = progress->expected.load(memory_order_relaxed);
+
+    // Smooth the instantaneous rate so the ETA doesn't jump around
+    double interval = current - progressLastTime;
+    if(interval > 0)
+    {
+        double instant = (bytes - progressLastBytes) / interval;
+        progressRate = (progressRate == 0) ? instant : 0.7 * progressRate + 0.3 * instant;
+    }
+    progressLastTime = current;
+    progressLastBytes = bytes;
+
+    double elapsed = current - progressStartTime;
+    double average = elapsed > 0 ? bytes / elapsed : 0;
+
+    ostringstream line;
+    line << "\r" << progressName << " ";
+
+    if(expected > 0)
+    {
+        line << progressBar(bytes, expected, PROGRESS_BAR_WIDTH) << " ";
+    }
+
+    if(final)
+    {
+        line << formatBytes(bytes) << "  avg " << formatBytes(average) << "/s";
+    }
+    else
+    {
+        line << formatBytes(bytes) << "  " << formatBytes(progressRate) << "/s (avg " 
+             << formatBytes(average) << "/s)";
+    }
+
+    if(!final && expected > 0 && progressRate > 0 && bytes < expected)
+    {
+        line << "  ETA " << formatEta((expected - bytes) / progressRate);
+    }
+
+    if(batchTotal > 0)
+    {
+        // The whole queue being run, timed from the start of 'run' so
+        // the gaps between transfers count against the ETA too
+        long long batchBytes = min(batchDone + bytes, batchTotal);
+        double batchElapsed = current - batchStartTime;
+        double batchRate = batchElapsed > 0 ? batchBytes / batchElapsed : 0;
+        line << "  | all " << progressBar(batchBytes, batchTotal, BATCH_BAR_WIDTH) << " " 
+             << formatBytes(batchBytes) << " of " << formatBytes(batchTotal);
+        if(!final && batchRate > 0 && batchBytes < batchTotal)
+        {
+            line << "  ETA " << formatEta((batchTotal - batchBytes) / batchRate);
+        }
+    }
+    else
+    {
+        // Totals for the session, including this transfer
+        double totalTime = sessionTime + elapsed;
+        line << "  | session " << formatBytes(sessionBytes + bytes) << " at " 
+             << formatBytes(totalTime > 0 ? (sessionBytes + bytes) / totalTime : 0) << "/s";
+    }
+
+    cout << line.str() << "\033[K" << flush;
+}
+
+/**
+ *  progressBar(long long done, long long total, int width)
+ * 
+ *  @param done Bytes moved
+ *  @param total Bytes to move, more than 0
+ *  @param width Characters inside the brackets
+ *  @return the bar and percentage, e.g. "[#####     ]  50%"
+ */
+string progressBar(long long done, long long total, int width)
+{
+    double fraction = min(1.0, (double)done / total);
+    int filled = (int)(fraction * width);
+
+    ostringstream bar;
+    bar << "[" << string(filled, '#') << string(width - filled, ' ') << "] " 
+        << setw(3) << (int)(fraction * 100) << "%";
+    return bar.str();
+}
+
+/**
+ *  formatEta(double seconds)
+ * 
+ *  @param seconds Time left
+ *  @return the time as minutes and seconds, e.g. "3:07"
+ */
+string formatEta(double seconds)
+{
+    long long eta = (long long)seconds;
+    ostringstream text;
+    text << eta / 60 << ":" << setw(2) << setfill('0') << eta % 60;
+    return text.str();
+}
+
+/**
+ *  transferLog(string text)
+ * 
+ *  Prints a message from the transfer process. The parent may
+ *  be drawing the progress line at the same time, so that line
+ *  is cleared first and the message is flushed straight away;
+ *  the next redraw puts the bar back underneath it.
+ * 
+ *  @param text Message, a newline is added if it has none
+ */
+void transferLog(string text)
+{
+    if(!quiet)
+    {
+        text = "\r\033[K" + text;
+    }
+    if(text.empty() || text.back() != '\n')
+    {
+        text += "\n";
+    }
+    cout << text << flush;
+}
+
+/**
+ *  formatBytes(double bytes)
+ * 
+ *  @param bytes Byte count
+ *  @return the count with a binary unit, e.g. "12.3 MB"
+ */
+string formatBytes(double bytes)
+{
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while(bytes >= 1024 && unit < 4)
+    {
+        bytes /= 1024;
+        unit++;
+    }
+
+    ostringstream text;
+    text << fixed << setprecision(unit == 0 ? 0 : 1) << bytes << " " << units[unit];
+    return text.str();
+}
+
+
+/**
+ *  queueLoad()
+ * 
+ *  Replays the journal in QUEUE_FILE into queueEntries, one
+ *  pass over its records, and keeps it open for appending.
+ *  A journal with nothing left to do is truncated.
+ */
+void queueLoad()
+{
+    ifstream journal(QUEUE_FILE);
+    string line;
+    while(getline(journal, line))
+    {
+        vector<string> fields;
+        istringstream record(line);
+        string field;
+        while(getline(record, field, '\t'))
+        {
+            fields.push_back(field);
+        }
+
+        // A record cut short by a crash is ignored
+        if(fields.size() < 2)
+        {
+            continue;
+        }
+
+        int id = atoi(fields[1].c_str());
+        char type = fields[0][0];
+
+        if(type == 'E' && fields.size() == 6 && id == (int)queueEntries.size())
+        {
+            QueueEntry entry;
+            entry.state = 'E';
+            entry.op = fields[2];
+            entry.host = fields[3];
+            entry.local = fields[4];
+            entry.remote = fields[5];
+            entry.offset = 0;
+            queueEntries.push_back(entry);
+        }
+        else if((type == 'S' || type == 'O' || type == 'D' || type == 'F') && fields.size() == 3 
+                && id >= 0 && id < (int)queueEntries.size())
+        {
+            queueEntries[id].state = (type == 'O') ? 'S' : type;
+            queueEntries[id].offset = atoll(fields[2].c_str());
+        }
+    }
+    journal.close();
+
+    int unfinished = 0;
+    for(const QueueEntry& entry : queueEntries)
+    {
+        if(entry.state == 'D')
+        {
+            queueDone.insert(queueKey(entry));
+        }
+        else if(entry.state != 'F')
+        {
+            unfinished++;
+        }
+    }
+
+    // Start a fresh journal if everything in it is done
+    int flags = O_WRONLY | O_CREAT | O_APPEND;
+    if(unfinished == 0)
+    {
+        queueEntries.clear();
+        queueDone.clear();
+        flags |= O_TRUNC;
+    }
+    queueFD = open(QUEUE_FILE, flags, S_IRUSR | S_IWUSR);
+
+    if(unfinished > 0)
+    {
+        cout << unfinished << " unfinished transfer(s) in " << QUEUE_FILE 
+             << ", type 'run' once connected to resume." << endl;
+    }
+}
+
+/**
+ *  queueAppend(string record, bool sync)
+ * 
+ *  Appends one record to the journal. Each record is a single
+ *  write() on an O_APPEND descriptor, so the forked transfer
+ *  process can checkpoint into the same file.
+ * 
+ *  @param record Tab separated fields, without the newline
+ *  @param sync True to fsync, used for state changes but not checkpoints
+ */
+void queueAppend(string record, bool sync)
+{
+    if(queueFD < 0)
+    {
+        return;
+    }
+
+    record += "\n";
+    write(queueFD, record.c_str(), record.size());
+
+    if(sync)
+    {
+        fdatasync(queueFD);
+    }
+}
+
+/**
+ *  queueAdd(string op, string local, string remote)
+ * 
+ *  Adds a transfer to the queue and journals it.
+ * 
+ *  @param op "get" or "put"
+ *  @param local Local file
+ *  @param remote Remote file, absolute from remotePath()
+ *  @return the id of the new entry
+ */
+int queueAdd(string op, string local, string remote)
+{
+    QueueEntry entry;
+    entry.state = 'E';
+    entry.op = op;
+    entry.host = hostname;
+    entry.local = local;
+    entry.remote = remote;
+    entry.offset = 0;
+
+    int id = queueEntries.size();
+    queueEntries.push_back(entry);
+    queueAppend("E\t" + to_string(id) + "\t" + op + "\t" + entry.host + "\t" 
+                + entry.local + "\t" + entry.remote, true);
+    return id;
+}
+
+/**
+ *  queueCommand(vector<string> inputArray)
+ * 
+ *  Handles 'queue': with no arguments shows the queue,
+ *  otherwise adds gets or a put to it. Files that were
+ *  already transferred are not added again.
+ * 
+ *  @param inputArray Vector of command line arguments
+ */
+void queueCommand(vector<string> inputArray)
+{
+    // inputArray always ends with an empty word from splitInput()
+    inputArray.pop_back();
+
+    if(inputArray.size() == 1)
+    {
+        for(size_t id = 0; id < queueEntries.size(); id++)
+        {
+            const QueueEntry& entry = queueEntries[id];
+            const char* state = entry.state == 'D' ? "done" : entry.state == 'F' ? "failed" 
+                              : (entry.state == 'S' ? "partial" : "queued");
+            cout << setw(5) << id << "  " << setw(7) << state << "  " << entry.op << "  " 
+                 << entry.local << (entry.op == "get" ? " <- " : " -> ") 
+                 << entry.host << ":" << entry.remote << "  " << entry.offset << " bytes" << endl;
+        }
+        return;
+    }
+
+    if(!isLoggedIn)
+    {
+        cout << "Not connected to server." << endl;
+        return;
+    }
+
+    string op = inputArray[1];
+    if(!(op == "get" && inputArray.size() >= 3) && !(op == "put" && (inputArray.size() == 3 
+                                                                   || inputArray.size() == 4)))
+    {
+        cout << "Incorrect arguments. Format: 'queue get remote...' or 'queue put local [remote]'" << endl;
+        return;
+    }
+
+    vector<pair<string, string>> files;     // local, remote
+    if(op == "get")
+    {
+        for(size_t i = 2; i < inputArray.size(); i++)
+        {
+            files.push_back(make_pair(inputArray[i], inputArray[i]));
+        }
+    }
+    else
+    {
+        files.push_back(make_pair(inputArray[2], inputArray.size() == 4 ? inputArray[3] : inputArray[2]));
+    }
+
+    // One PWD for the whole command rather than one per file
+    string dir = remoteDir();
+
+    for(const pair<string, string>& file : files)
+    {
+        string local = file.first;
+        if(op == "put" && !verifyFile(local))
+        {
+            cout << file.first << " cannot be found." << endl;
+            continue;
+        }
+
+        // Skip anything the journal says is already done
+        QueueEntry entry;
+        entry.op = op;
+        entry.host = hostname;
+        entry.local = file.first;
+        entry.remote = (file.second.empty() || file.second[0] == '/') ? file.second : dir + file.second;
+        if(queueDone.count(queueKey(entry)) > 0)
+        {
+            cout << file.first << " already transferred, skipping." << endl;
+            continue;
+        }
+
+        int id = queueAdd(op, entry.local, entry.remote);
+        cout << "Queued " << id << ": " << op << " " << file.first << endl;
+    }
+}
+
+/**
+ *  runQueue()
+ * 
+ *  Runs every unfinished transfer for this server in queue
+ *  order. Partial ones are resumed where they stopped. The
+ *  sizes are added up first, local ones for puts and the meta
+ *  index or SIZE for gets, so the progress line can show the
+ *  whole batch.
+ */
+void runQueue()
+{
+    int succeeded = 0;
+    int failed = 0;
+
+    vector<size_t> ids;
+    vector<long long> sizes;       // Bytes still to move for each of ids, -1 if unknown
+    long long total = 0;
+    for(size_t id = 0; id < queueEntries.size(); id++)
+    {
+        const QueueEntry& entry = queueEntries[id];
+        if(entry.state == 'D' || entry.state == 'F' || entry.host != hostname)
+        {
+            continue;
+        }
+
+        long long size = -1;
+        if(entry.op == "put")
+        {
+            struct stat localStat;
+            if(stat(entry.local.c_str(), &localStat) == 0)
+            {
+                size = localStat.st_size - entry.offset;
+            }
+        }
+        else
+        {
+            // Resumed from the local size, as in runEntry()
+            const FileMeta* fileMeta = findMeta(entry.remote);
+            size = (fileMeta != NULL) ? fileMeta->size : remoteSize(entry.remote);
+            struct stat localStat;
+            if(size >= 0 && entry.offset > 0 && stat(entry.local.c_str(), &localStat) == 0)
+            {
+                size -= localStat.st_size;
+            }
+        }
+
+        ids.push_back(id);
+        sizes.push_back(max(size, -1LL));
+        total = (size < 0 || total < 0) ? -1 : total + size;
+    }
+
+    batchTotal = total;
+    batchDone = 0;
+    batchStartTime = now();
+
+    for(size_t i = 0; i < ids.size(); i++)
+    {
+        if(runEntry(ids[i]))
+        {
+            succeeded++;
+        }
+        else
+        {
+            failed++;
+        }
+
+        // Done with it either way, the batch moves on to the next
+        batchDone += sizes[i];
+    }
+    batchTotal = -1;
+
+    cout << succeeded << " transfer(s) finished, " << failed << " failed." << endl;
+}
+
+/**
+ *  runEntry(int id)
+ * 
+ *  Runs one queued transfer. A transfer the server refuses
+ *  with a 5xx reply is marked failed so it isn't retried;
+ *  anything else stays resumable. The resume offset comes from the
+ *  local file size for a get (what really reached the disk) and
+ *  from SIZE on the server for a put, falling back to the last
+ *  checkpoint if the server won't say. A get is only resumed
+ *  once the journal has an offset past 0; before that the local
+ *  file may still be an old copy the transfer never truncated.
+ * 
+ *  @param id Entry in queueEntries
+ *  @return bool representing if the transfer finished
+ */
+bool runEntry(int id)
+{
+    QueueEntry& entry = queueEntries[id];
+    long long offset = 0;
+
+    if(entry.state == 'S')
+    {
+        if(entry.op == "get")
+        {
+            struct stat localStat;
+            if(entry.offset > 0 && stat(entry.local.c_str(), &localStat) == 0)
+            {
+                offset = localStat.st_size;
+            }
+        }
+        else
+        {
+            offset = remoteSize(entry.remote);
+            if(offset < 0)
+            {
+                offset = entry.offset;
+            }
+        }
+
+        if(offset > 0)
+        {
+            cout << "Resuming " << entry.local << " at " << offset << " bytes." << endl;
+        }
+    }
+
+    // A new upload may already be on the server, then no data connection is needed
+    ContentHash hash;
+    bool hashed = (entry.op == "put" && offset == 0 && hashFile(entry.local, hash));
+    bool finished = hashed && dedupPut(hash, entry.remote);
+
+    if(!finished)
+    {
+        entry.state = 'S';
+        entry.offset = offset;
+        queueAppend("S\t" + to_string(id) + "\t" + to_string(offset), true);
+
+        // Let transferLoop() checkpoint the offset as it goes
+        queueActive = id;
+        queueBase = offset;
+        queueCheckpointed = offset;
+
+        finished = (entry.op == "get") ? getFile(entry.remote, entry.local, offset) 
+                                       : putFile(entry.local, entry.remote, offset);
+
+        queueActive = -1;
+    }
+
+    if(finished)
+    {
+        struct stat localStat;
+        stat(entry.local.c_str(), &localStat);
+        entry.state = 'D';
+        entry.offset = localStat.st_size;
+        queueAppend("D\t" + to_string(id) + "\t" + to_string(entry.offset), true);
+        queueDone.insert(queueKey(entry));
+
+        // finished means the server confirmed STOR or SITE CPTO with 226/250,
+        // so the content really is at that path now
+        if(hashed)
+        {
+            dedupRecord(hash, entry.remote);
+        }
+    }
+    else if(transferRefused)
+    {
+        entry.state = 'F';
+        queueAppend("F\t" + to_string(id) + "\t" + to_string(entry.offset), true);
+    }
+
+    return finished;
+}
+
+/**
+ *  queueCheckpoint(long long transferred)
+ * 
+ *  Records the offset of the active transfer every
+ *  CHECKPOINT_BYTES. Called from transferLoop() in the
+ *  forked transfer process.
+ * 
+ *  @param transferred Bytes moved since the transfer started
+ */
+void queueCheckpoint(long long transferred)
+{
+    if(queueActive < 0 || queueBase + transferred - queueCheckpointed < CHECKPOINT_BYTES)
+    {
+        return;
+    }
+
+    queueCheckpointed = queueBase + transferred;
+    queueAppend("O\t" + to_string(queueActive) + "\t" + to_string(queueCheckpointed), false);
+}
+
+/**
+ *  queueKey(const QueueEntry& entry)
+ * 
+ *  @param entry Queue entry
+ *  @return op, host, local and remote file joined by tabs, which records never contain
+ */
+string queueKey(const QueueEntry& entry)
+{
+    return entry.op + "\t" + entry.host + "\t" + entry.local + "\t" + entry.remote;
+}
+
+/**
+ *  remotePath(string name)
+ * 
+ *  Turns a name relative to the current remote directory
+ *  into an absolute path, so queued transfers don't depend
+ *  on where the user has cd'd to.
+ * 
+ *  @param name Remote file name
+ *  @return the absolute path, or name if the server won't say
+ */
+string remotePath(string name)
+{
+    if(name.empty() || name[0] == '/')
+    {
+        return name;
+    }
+
+    return remoteDir() + name;
+}
+
+/**
+ *  remoteDir()
+ * 
+ *  Asks the server for the current directory with PWD.
+ * 
+ *  @return the directory ending in '/', or "" if the server won't say
+ */
+string remoteDir()
+{
+    // Reply is 257 "/current/dir" ...
+    sendCommand("PWD");
+    string reply;
+    if(readReply(reply) != 257)
+    {
+        return "";
+    }
+
+    size_t open = reply.find('"');
+    size_t close = reply.find('"', open + 1);
+    if(open == string::npos || close == string::npos)
+    {
+        return "";
+    }
+
+    string dir = reply.substr(open + 1, close - open - 1);
+    if(dir.empty() || dir.back() != '/')
+    {
+        dir += "/";
+    }
+    return dir;
+}
+
+
+/**
+ *  hashFile(string name, ContentHash& hash)
+ * 
+ *  Hashes a local file with MurmurHash3 (x64, 128-bit, seed 0),
+ *  reading it in large blocks. Not cryptographic, but together
+ *  with the size an accidental match is not a practical concern.
+ * 
+ *  @param name Local file
+ *  @param hash Set to the hash and size of the file
+ *  @return bool representing if the file could be read
+ */
+bool hashFile(string name, ContentHash& hash)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto fmix = [](uint64_t k)
+    {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    };
+
+    int file = open(name.c_str(), O_RDONLY);
+    if(file < 0)
+    {
+        return false;
+    }
+
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    uint64_t length = 0;
+    vector<unsigned char> data(MAX_CHUNK);     // Multiple of the 16 byte block
+
+    while(true)
+    {
+        // Fill the whole buffer so only the last one has a partial block
+        size_t filled = 0;
+        ssize_t numRead = 0;
+        while(filled < data.size() && (numRead = read(file, data.data() + filled, data.size() - filled)) > 0)
+        {
+            filled += numRead;
+        }
+        if(numRead < 0)
+        {
+            close(file);
+            return false;
+        }
+        length += filled;
+
+        size_t blocks = filled / 16;
+        for(size_t i = 0; i < blocks; i++)
+        {
+            uint64_t k1;
+            uint64_t k2;
+            memcpy(&k1, data.data() + i * 16, 8);
+            memcpy(&k2, data.data() + i * 16 + 8, 8);
+
+            k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+            h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+            k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+            h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+        }
+
+        if(filled < data.size())
+        {
+            // End of file, mix in the tail
+            const unsigned char* tail = data.data() + blocks * 16;
+            size_t tailLength = filled % 16;
+            uint64_t k1 = 0;
+            uint64_t k2 = 0;
+            for(size_t i = tailLength; i > 8; i--)
+            {
+                k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+            }
+            for(size_t i = min(tailLength, (size_t)8); i > 0; i--)
+            {
+                k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+            }
+            if(tailLength > 8)
+            {
+                k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+            }
+            if(tailLength > 0)
+            {
+                k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+            }
+            break;
+        }
+    }
+    close(file);
+
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix(h1);
+    h2 = fmix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    hash.h1 = h1;
+    hash.h2 = h2;
+    hash.size = length;
+    return true;
+}
+
+/**
+ *  dedupLoad()
+ * 
+ *  Reads DEDUP_FILE into dedupIndex in one pass and keeps it
+ *  open for appending. A record cut short by a crash ends
+ *  the replay.
+ */
+void dedupLoad()
+{
+    ifstream index(DEDUP_FILE, ios::binary);
+    DedupRecord record;
+    while(index.read((char*)&record, sizeof(record)))
+    {
+        string server(record.hostLength, '\0');
+        string path(record.pathLength, '\0');
+        if(!index.read(&server[0], record.hostLength) || !index.read(&path[0], record.pathLength))
+        {
+            break;
+        }
+
+        ContentHash hash;
+        hash.h1 = record.h1;
+        hash.h2 = record.h2;
+        hash.size = record.size;
+        dedupAdd(dedupKey(hash, server), server, path);
+    }
+    index.close();
+
+    dedupFD = open(DEDUP_FILE, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+}
+
+/**
+ *  dedupKey(const ContentHash& hash, string server)
+ * 
+ *  @param hash Content hash and size
+ *  @param server Host the content was uploaded to
+ *  @return the key for dedupIndex
+ */
+string dedupKey(const ContentHash& hash, string server)
+{
+    string key((const char*)&hash.h1, sizeof(hash.h1));
+    key.append((const char*)&hash.h2, sizeof(hash.h2));
+    key.append((const char*)&hash.size, sizeof(hash.size));
+    return key + server;
+}
+
+/**
+ *  dedupRecord(const ContentHash& hash, string remote)
+ * 
+ *  Remembers that the server now has this content at remote,
+ *  in dedupIndex and on disk.
+ * 
+ *  @param hash Content hash and size
+ *  @param remote Absolute remote path
+ */
+void dedupRecord(const ContentHash& hash, string remote)
+{
+    if(!dedupAdd(dedupKey(hash, hostname), hostname, remote) || dedupFD < 0)
+    {
+        return;
+    }
+
+    DedupRecord record;
+    record.h1 = hash.h1;
+    record.h2 = hash.h2;
+    record.size = hash.size;
+    record.hostLength = strlen(hostname);
+    record.pathLength = remote.size();
+
+    string data((const char*)&record, sizeof(record));
+    data += hostname;
+    data += remote;
+    write(dedupFD, data.c_str(), data.size());
+}
+
+/**
+ *  dedupAdd(string key, string server, string path)
+ * 
+ *  Adds a path to dedupIndex. A path holds one content at a
+ *  time, so it is taken off whatever content it had before.
+ * 
+ *  @param key dedupKey() of the content
+ *  @param server Host the path is on
+ *  @param path Absolute remote path
+ *  @return bool representing if the index changed
+ */
+bool dedupAdd(string key, string server, string path)
+{
+    auto previous = dedupPaths.find(server + path);
+    if(previous != dedupPaths.end())
+    {
+        if(previous->second == key)
+        {
+            return false;
+        }
+        dedupRemove(previous->second, server, path);
+    }
+
+    dedupPaths[server + path] = key;
+    dedupIndex[key].push_back(path);
+    return true;
+}
+
+/**
+ *  dedupRemove(string key, string server, string path)
+ * 
+ *  Takes a path off a content in dedupIndex.
+ * 
+ *  @param key dedupKey() of the content
+ *  @param server Host the path is on
+ *  @param path Absolute remote path
+ */
+void dedupRemove(string key, string server, string path)
+{
+    vector<string>& paths = dedupIndex[key];
+    paths.erase(remove(paths.begin(), paths.end(), path), paths.end());
+    if(paths.empty())
+    {
+        dedupIndex.erase(key);
+    }
+    dedupPaths.erase(server + path);
+}
+
+/**
+ *  dedupPut(const ContentHash& hash, string remote)
+ * 
+ *  Checks whether the server already has this content. If it is
+ *  at the same path the upload is skipped. If it is somewhere
+ *  else it is copied on the server with SITE CPFR/CPTO. Either
+ *  way the server's SIZE is checked first so a deleted or
+ *  changed file is not trusted. Copies that fail the check are
+ *  dropped from the in-memory index.
+ * 
+ *  @param hash Content hash and size of the local file
+ *  @param remote Absolute remote path to upload to
+ *  @return bool representing if the upload is no longer needed
+ */
+bool dedupPut(const ContentHash& hash, string remote)
+{
+    dedupChecked++;
+
+    string key = dedupKey(hash, hostname);
+    auto found = dedupIndex.find(key);
+    if(found == dedupIndex.end())
+    {
+        return false;
+    }
+    vector<string> paths = found->second;
+
+    // Already at this path, as long as the server's copy is still the same size
+    if(find(paths.begin(), paths.end(), remote) != paths.end())
+    {
+        if(remoteSize(remote) == hash.size)
+        {
+            cout << remote << " is already on the server, skipping upload." << endl;
+            dedupSkipped++;
+            dedupBytesSaved += hash.size;
+            return true;
+        }
+
+        // Changed since we uploaded it
+        dedupRemove(key, hostname, remote);
+    }
+
+    // Find another copy that still looks intact
+    string source;
+    for(const string& path : paths)
+    {
+        if(path == remote)
+        {
+            continue;
+        }
+        if(remoteSize(path) == hash.size)
+        {
+            source = path;
+            break;
+        }
+        dedupRemove(key, hostname, path);
+    }
+
+    if(source.empty())
+    {
+        return false;
+    }
+
+    if(!siteCopySupported)
+    {
+        return false;
+    }
+
+    string reply;
+    sendCommand("SITE CPFR " + source);
+    int code = readReply(reply);
+    cout << reply;
+    if(code != 350)
+    {
+        // Only ask once per session if the server doesn't know the command,
+        // other errors such as 550 are about this path
+        if(code == 500 || code == 502 || code == 504)
+        {
+            siteCopySupported = false;
+        }
+        return false;
+    }
+
+    sendCommand("SITE CPTO " + remote);
+    code = readReply(reply);
+    cout << reply;
+    if(code != 250 && code != 226)
+    {
+        return false;
+    }
+
+    cout << "Copied " << source << " to " << remote << " on the server." << endl;
+    dedupCopied++;
+    dedupBytesSaved += hash.size;
+    return true;
+}
+
+/**
+ *  remoteSize(string remote)
+ * 
+ *  @param remote Remote file
+ *  @return the size SIZE reports in binary mode, or -1 if it fails
+ */
+long long remoteSize(string remote)
+{
+    setTypeI();
+    sendCommand("SIZE " + remote);
+    string reply;
+    return (readReply(reply) == 213) ? atoll(reply.c_str() + 4) : -1;
+}
+
+/**
+ *  dedupStats()
+ * 
+ *  Prints how many uploads this session were avoided and
+ *  how many bytes that saved.
+ */
+void dedupStats()
+{
+    int hits = dedupSkipped + dedupCopied;
+    cout << "Uploads checked: " << dedupChecked << ", already on server: " << dedupSkipped 
+         << ", copied on server: " << dedupCopied << endl;
+    cout << "Hit rate: " << (dedupChecked > 0 ? 100 * hits / dedupChecked : 0) << "%, " 
+         << formatBytes(dedupBytesSaved) << " not sent, " << dedupIndex.size() 
+         << " distinct files in " << DEDUP_FILE << endl;
+}
+
+
+/**
+ *  fxp(vector<string> inputArray)
+ * 
+ *  Copies a file from the connected server to another one
+ *  without the data passing through this client. The source
+ *  is put in passive mode, the destination is given that
+ *  address with PORT, then STOR on the destination and RETR
+ *  on the source start the transfer between them. This client
+ *  only watches both control connections for completion, and
+ *  sends ABOR to one side as soon as the other fails.
+ * 
+ *  @param inputArray Vector of command line arguments
+ */
+void fxp(vector<string> inputArray)
+{
+    // inputArray always ends with an empty word from splitInput()
+    inputArray.pop_back();
+
+    if(inputArray.size() < 3 || inputArray.size() > 5)
+    {
+        cout << "Incorrect arguments. Format: 'fxp file host [port] [remotefile]'" << endl;
+        return;
+    }
+
+    string file = inputArray[1];
+    string destHost = inputArray[2];
+    int destPort = 21;
+    string destFile = file;
+    if(inputArray.size() >= 4)
+    {
+        // A number is the port, anything else the destination name
+        if(all_of(inputArray[3].begin(), inputArray[3].end(), ::isdigit))
+        {
+            destPort = stoi(inputArray[3]);
+            if(inputArray.size() == 5)
+            {
+                destFile = inputArray[4];
+            }
+        }
+        else if(inputArray.size() == 4)
+        {
+            destFile = inputArray[3];
+        }
+        else
+        {
+            cout << "Incorrect arguments. Format: 'fxp file host [port] [remotefile]'" << endl;
+            return;
+        }
+    }
+
+    string destPending;
+    int destSD = fxpConnect(destHost, destPort, destPending);
+    if(destSD < 0)
+    {
+        return;
+    }
+
+    string reply;
+    long long size = remoteSize(file);
+
+    // Both sides binary, the source listens and the destination connects to it
+    uint32_t address;
+    uint16_t port;
+    sendCommand("PASV");
+    readReply(reply);
+    cout << "[source] " << reply;
+    if(fxpCommand(destSD, destPending, "TYPE I", "dest") != 200 
+       || !parsePasv(reply.data(), reply.size(), &address, &port))
+    {
+        cout << "Could not set up the transfer." << endl;
+        fxpCommand(destSD, destPending, "QUIT", "dest");
+        close(destSD);
+        return;
+    }
+
+    ostringstream portCommand;
+    portCommand << "PORT " << (address >> 24) << "," << ((address >> 16) & 255) << "," 
+                << ((address >> 8) & 255) << "," << (address & 255) << "," 
+                << (port >> 8) << "," << (port & 255);
+    if(fxpCommand(destSD, destPending, portCommand.str(), "dest") != 200)
+    {
+        cout << "Destination refused PORT, it may not allow server-to-server transfers." << endl;
+        fxpCommand(destSD, destPending, "QUIT", "dest");
+        close(destSD);
+        return;
+    }
+
+    // Destination first, so it is waiting for the data when the source sends it
+    double start = now();
+    sendCommandTo(destSD, "STOR " + destFile);
+    sendCommand("RETR " + file);
+
+    // Each side sends a preliminary 1xx reply then a final one. Either may
+    // fail first, so watch both and abort the other instead of waiting on it
+    int sds[2] = { clientSD, destSD };
+    string* pendings[2] = { &controlPending, &destPending };
+    const char* labels[2] = { "[source] ", "[dest] " };
+    int finals[2] = { 0, 0 };           // Final reply code, 0 while still waiting
+    bool aborted[2] = { false, false };
+
+    while(finals[0] == 0 || finals[1] == 0)
+    {
+        // A reply already read into pending won't show up in poll()
+        bool ready[2] = { false, false };
+        bool buffered = false;
+        for(int side = 0; side < 2; side++)
+        {
+            int code;
+            ready[side] = finals[side] == 0 
+                          && parseReply(pendings[side]->data(), pendings[side]->size(), &code) > 0;
+            buffered = buffered || ready[side];
+        }
+
+        if(!buffered)
+        {
+            struct pollfd fds[2];
+            int sides[2];
+            int watched = 0;
+            for(int side = 0; side < 2; side++)
+            {
+                if(finals[side] == 0)
+                {
+                    fds[watched].fd = sds[side];
+                    fds[watched].events = POLLIN;
+                    fds[watched].revents = 0;
+                    sides[watched++] = side;
+                }
+            }
+            poll(fds, watched, -1);
+            for(int i = 0; i < watched; i++)
+            {
+                ready[sides[i]] = fds[i].revents != 0;
+            }
+        }
+
+        for(int side = 0; side < 2; side++)
+        {
+            if(!ready[side])
+            {
+                continue;
+            }
+
+            int code = readReplyFrom(sds[side], *pendings[side], reply);
+            cout << labels[side] << reply;
+            if(code >= 100 && code < 200)
+            {
+                continue;
+            }
+            finals[side] = code;
+
+            // Nothing more is coming from this side, don't leave the other waiting for it
+            int other = 1 - side;
+            if((code < 200 || code >= 300) && finals[other] == 0)
+            {
+                sendCommandTo(sds[other], "ABOR");
+                aborted[other] = true;
+            }
+        }
+    }
+    double elapsed = now() - start;
+
+    // Replies to ABOR. The server sends 426 for the transfer then 226, or
+    // just 225/226 if the transfer had already ended; either way the reply
+    // read above is the transfer's, so read up to the next 2xx
+    for(int side = 0; side < 2; side++)
+    {
+        struct pollfd fds;
+        fds.fd = sds[side];
+        fds.events = POLLIN;
+        while(aborted[side] && finals[side] > 0)
+        {
+            int code;
+            fds.revents = 0;
+            if(parseReply(pendings[side]->data(), pendings[side]->size(), &code) == 0 
+               && poll(&fds, 1, ACCEPT_TIMEOUT_MS) <= 0)
+            {
+                break;
+            }
+
+            code = readReplyFrom(sds[side], *pendings[side], reply);
+            cout << labels[side] << reply;
+            if(code < 0 || (code >= 200 && code < 300))
+            {
+                break;
+            }
+        }
+    }
+
+    bool sourceOK = finals[0] >= 200 && finals[0] < 300;
+    bool destOK = finals[1] >= 200 && finals[1] < 300;
+    if(sourceOK && destOK)
+    {
+        cout << "Copied " << file << " to " << destHost << ":" << destFile;
+        if(size >= 0)
+        {
+            cout << ", " << formatBytes(size) << " at " << formatBytes(size / elapsed) << "/s";
+        }
+        cout << "." << endl;
+    }
+    else
+    {
+        cout << "Server-to-server transfer failed." << endl;
+    }
+
+    fxpCommand(destSD, destPending, "QUIT", "dest");
+    close(destSD);
+}
+
+/**
+ *  fxpConnect(string name, int port, string& pending)
+ * 
+ *  Opens and logs in a second control connection for fxp(),
+ *  prompting for the username and password like open().
+ *  Uses getaddrinfo() so the host of the main connection,
+ *  which gethostbyname() keeps in static storage, is left alone.
+ * 
+ *  @param name Destination server
+ *  @param port Destination control port
+ *  @param pending Data read past the last reply on the new connection
+ *  @return the connected socket, or -1 on failure
+ */
+int fxpConnect(string name, int port, string& pending)
+{
+    struct addrinfo hints;
+    struct addrinfo* result;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(name.c_str(), to_string(port).c_str(), &hints, &result) != 0)
+    {
+        cout << "Cannot find " << name << "." << endl;
+        return -1;
+    }
+
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    int connected = (sd < 0) ? -1 : connect(sd, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+
+    string reply;
+    if(connected < 0 || readReplyFrom(sd, pending, reply) != 220)
+    {
+        cout << "Cannot connect to " << name << "." << endl;
+        if(sd >= 0)
+        {
+            close(sd);
+        }
+        return -1;
+    }
+    cout << "[dest] " << reply;
+
+    // Get user's username
+    cout << "---> Username (" << name << ":" << getenv("USER") << "): ";
+    string username;
+    getline(cin, username);
+    int code = fxpCommand(sd, pending, "USER " + username, "dest");
+
+    if(code == 331)
+    {
+        cout << "---> Enter Password: ";
+        string userPassword;
+        getline(cin, userPassword);
+        code = fxpCommand(sd, pending, "PASS " + userPassword, "dest");
+    }
+
+    if(code != 230)
+    {
+        cout << "Login to " << name << " failed." << endl;
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+/**
+ *  fxpCommand(int sd, string& pending, string command, string label)
+ * 
+ *  Sends a command on a control connection and prints
+ *  the reply.
+ * 
+ *  @param sd Control connection
+ *  @param pending Data read past the last reply on this connection
+ *  @param command Command and its arguments
+ *  @param label Which server this is, printed before the reply
+ *  @return the reply code, or -1 if the connection closed
+ */
+int fxpCommand(int sd, string& pending, string command, string label)
+{
+    sendCommandTo(sd, command);
+
+    string reply;
+    int code = readReplyFrom(sd, pending, reply);
+    cout << "[" << label << "] " << reply;
+    return code;
+}
+
+
+/**
+ *  dataConnect()
+ * 
+ *  Prepares the data connection for the next transfer
+ *  command. In passive mode this connects with pasv(). In
+ *  active mode it tells the server where to connect with
+ *  port(), and dataAccept() picks the connection up once
+ *  the command has been sent. The previous transfer is over
+ *  by now, so its listener is retired first.
+ * 
+ *  @return bool representing if the server accepted it
+ */
+bool dataConnect()
+{
+    listenerRetire();
+
+    if(activeMode)
+    {
+        return port();
+    }
+
+    return pasv();
+}
+
+/**
+ *  dataAccept()
+ * 
+ *  In active mode, waits for the server to connect to the
+ *  listener given in port() and sets passiveSD. While waiting
+ *  the control connection is peeked at (not read), so an error
+ *  reply to the transfer command ends the wait instead of the
+ *  timeout. A connection from any address other than the
+ *  server's is closed. Does nothing in passive mode.
+ * 
+ *  @return bool representing if there is a data connection
+ */
+bool dataAccept()
+{
+    if(activeListener < 0)
+    {
+        return true;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = activeListener;
+    fds[0].events = POLLIN;
+    fds[1].fd = clientSD;
+    fds[1].events = POLLIN;
+    int watched = 2;
+
+    while(true)
+    {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if(poll(fds, watched, ACCEPT_TIMEOUT_MS) <= 0)
+        {
+            transferLog("Server did not open the data connection.");
+            return false;
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            struct sockaddr_in peer;
+            socklen_t peerLen = sizeof(peer);
+            passiveSD = accept(activeListener, (sockaddr*)&peer, &peerLen);
+            if(passiveSD < 0)
+            {
+                continue;
+            }
+
+            // Anyone can connect to the listener, only take the server's connection
+            struct sockaddr_in server;
+            socklen_t serverLen = sizeof(server);
+            if(getpeername(clientSD, (sockaddr*)&server, &serverLen) < 0 
+               || peer.sin_addr.s_addr != server.sin_addr.s_addr)
+            {
+                transferLog("Refused a data connection from " + string(inet_ntoa(peer.sin_addr)) + ".");
+                close(passiveSD);
+                continue;
+            }
+
+            // The listener is non-blocking, the data connection shouldn't be
+            fcntl(passiveSD, F_SETFL, fcntl(passiveSD, F_GETFL) & ~O_NONBLOCK);
+            return true;
+        }
+
+        if(fds[1].revents & POLLIN)
+        {
+            char reply[BUFF_SIZE];
+            ssize_t numRead = recv(clientSD, reply, sizeof(reply), MSG_PEEK);
+            if(numRead <= 0 || lastReplyCode(reply, numRead) >= 400)
+            {
+                return false;
+            }
+
+            // A 1xx reply, the connection should follow. Stop watching
+            // control since the peeked data stays readable
+            watched = 1;
+        }
+    }
+}
+
+/**
+ *  port()
+ * 
+ *  Active mode counterpart of pasv(). Takes the oldest listener
+ *  from the pool and tells the server its address with EPRT,
+ *  or PORT if the server doesn't know EPRT. No socket is made
+ *  here, the pool is kept full by listenerRetire().
+ * 
+ *  @return bool representing if the server accepted the address
+ */
+bool port()
+{
+    if(!listenerPoolFill())
+    {
+        cout << "Could not listen for data connections." << endl;
+        return false;
+    }
+
+    // Never handed out before, so its port can't be in TIME_WAIT with the server.
+    // It is closed by listenerRetire() whether or not the server accepts it
+    int listener = listenerPool.front();
+    listenerPool.pop_front();
+    activeListener = listener;
+
+    struct sockaddr_in address;
+    socklen_t addressLen = sizeof(address);
+    getsockname(listener, (sockaddr*)&address, &addressLen);
+    uint32_t ip = ntohl(address.sin_addr.s_addr);
+    uint16_t listenPort = ntohs(address.sin_port);
+
+    string reply;
+    int code = -1;
+    if(eprtSupported)
+    {
+        sendCommand("EPRT |1|" + string(inet_ntoa(address.sin_addr)) + "|" + to_string(listenPort) + "|");
+        code = readReply(reply);
+        cout << reply;
+
+        if(code == 500 || code == 501 || code == 502)
+        {
+            eprtSupported = false;
+        }
+    }
+
+    if(!eprtSupported)
+    {
+        ostringstream command;
+        command << "PORT " << (ip >> 24) << "," << ((ip >> 16) & 255) << "," << ((ip >> 8) & 255) 
+                << "," << (ip & 255) << "," << (listenPort >> 8) << "," << (listenPort & 255);
+        sendCommand(command.str());
+        code = readReply(reply);
+        cout << reply;
+    }
+
+    if(code != 200)
+    {
+        cout << "Server did not accept the data address." << endl;
+        return false;
+    }
+
+    passiveSD = -1;
+    return true;
+}
+
+/**
+ *  listenerPoolFill()
+ * 
+ *  Tops the pool up to LISTENER_POOL_SIZE sockets bound to the
+ *  address the control connection uses, each on a new port
+ *  from the kernel and already listening, so transfers in active
+ *  mode don't pay for socket/bind/listen. Each is non-blocking
+ *  so dataAccept() can't hang on a connection that went away.
+ * 
+ *  @return bool representing if the pool has listeners
+ */
+bool listenerPoolFill()
+{
+    struct sockaddr_in address;
+    socklen_t addressLen = sizeof(address);
+    if(getsockname(clientSD, (sockaddr*)&address, &addressLen) < 0)
+    {
+        return false;
+    }
+    address.sin_port = 0;
+
+    while(listenerPool.size() < (size_t)LISTENER_POOL_SIZE)
+    {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        if(listener < 0)
+        {
+            break;
+        }
+
+        if(bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 1) < 0)
+        {
+            close(listener);
+            break;
+        }
+
+        fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+        listenerPool.push_back(listener);
+    }
+
+    return !listenerPool.empty();
+}
+
+/**
+ *  listenerRetire()
+ * 
+ *  Closes the listener of the last active mode transfer and
+ *  replaces it in the pool. Ports are not reused because a
+ *  server connecting from port 20 closes first and keeps the
+ *  old connection in TIME_WAIT, so connecting to the same port
+ *  again fails with 425 until that expires.
+ */
+void listenerRetire()
+{
+    if(activeListener < 0)
+    {
+        return;
+    }
+
+    close(activeListener);
+    activeListener = -1;
+    listenerPoolFill();
+}
+
+/**
+ *  listenerPoolClose()
+ * 
+ *  Closes the listeners made by listenerPoolFill(), including
+ *  the one in use.
+ */
+void listenerPoolClose()
+{
+    for(int listener : listenerPool)
+    {
+        close(listener);
+    }
+    listenerPool.clear();
+    if(activeListener >= 0)
+    {
+        close(activeListener);
     }
+    activeListener = -1;
+    eprtSupported = true;
 }
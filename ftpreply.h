@@ -0,0 +1,188 @@
+#ifndef FTPREPLY_H
+#define FTPREPLY_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ *  ftpreply.h
+ *
+ *  Parsing of FTP control connection replies (RFC 959),
+ *  kept apart from ftp.cpp so it can be used without a
+ *  server. Nothing here allocates or needs the buffer
+ *  to be null terminated.
+ *
+ *  A reply is either one line, "123 text\r\n", or several,
+ *  "123-first\r\n ... \r\n123 last\r\n", ending on the first
+ *  line that starts with the same code followed by a space.
+ */
+
+/**
+ *  replyCodeAt(const char* line, size_t length)
+ *
+ *  @param line Start of a line
+ *  @param length Bytes available from line
+ *  @return the three digit code the line starts with, or -1 if it doesn't
+ */
+inline int replyCodeAt(const char* line, size_t length)
+{
+    if(length < 3 || line[0] < '1' || line[0] > '5' || line[1] < '0' || line[1] > '9'
+       || line[2] < '0' || line[2] > '9')
+    {
+        return -1;
+    }
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+/**
+ *  parseReply(const char* data, size_t length, int* code)
+ *
+ *  Finds the end of the first reply in data. A line that
+ *  doesn't start with a reply code is returned on its own
+ *  with code -1, so the caller can skip it.
+ *
+ *  @param data Bytes read from the control connection
+ *  @param length Number of bytes in data
+ *  @param code Set to the reply code
+ *  @return the length of the reply including its last newline, 0 if it is incomplete
+ */
+inline size_t parseReply(const char* data, size_t length, int* code)
+{
+    *code = -1;
+
+    // First line decides whether this is a multi-line reply
+    const char* end = data + length;
+    const char* newline = data;
+    while(newline < end && *newline != '\n')
+    {
+        newline++;
+    }
+    if(newline == end)
+    {
+        return 0;
+    }
+
+    int first = replyCodeAt(data, newline - data);
+    if(first < 0 || newline - data < 4 || data[3] != '-')
+    {
+        *code = first;
+        return newline + 1 - data;
+    }
+
+    // Multi-line, look for "code " at the start of a later line
+    const char* line = newline + 1;
+    while(line < end)
+    {
+        newline = line;
+        while(newline < end && *newline != '\n')
+        {
+            newline++;
+        }
+        if(newline == end)
+        {
+            return 0;
+        }
+
+        if(newline - line >= 4 && replyCodeAt(line, newline - line) == first && line[3] == ' ')
+        {
+            *code = first;
+            return newline + 1 - data;
+        }
+        line = newline + 1;
+    }
+    return 0;
+}
+
+/**
+ *  lastReplyCode(const char* data, size_t length)
+ *
+ *  @param data Bytes read from the control connection
+ *  @param length Number of bytes in data
+ *  @return the code of the last complete reply in data, or -1 if there is none
+ */
+inline int lastReplyCode(const char* data, size_t length)
+{
+    int last = -1;
+    int found;
+    size_t used;
+    while((used = parseReply(data, length, &found)) > 0)
+    {
+        if(found > 0)
+        {
+            last = found;
+        }
+        data += used;
+        length -= used;
+    }
+    return last;
+}
+
+/**
+ *  parsePasv(const char* data, size_t length, uint32_t* address, uint16_t* port)
+ *
+ *  Finds the 227 reply in data and reads the six numbers of
+ *  "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)". Servers
+ *  word the text differently, so the numbers are taken from
+ *  the first digit after the code, with or without brackets.
+ *
+ *  @param data Bytes read from the control connection
+ *  @param length Number of bytes in data
+ *  @param address Set to the IPv4 address, host byte order
+ *  @param port Set to the port, host byte order
+ *  @return bool representing if a well formed 227 reply was found
+ */
+inline bool parsePasv(const char* data, size_t length, uint32_t* address, uint16_t* port)
+{
+    int code;
+    size_t used;
+    while((used = parseReply(data, length, &code)) > 0 && code != 227)
+    {
+        data += used;
+        length -= used;
+    }
+    if(used == 0)
+    {
+        return false;
+    }
+
+    // Skip the code, then anything up to the first number
+    const char* text = data + 4;
+    const char* end = data + used;
+    while(text < end && (*text < '0' || *text > '9'))
+    {
+        text++;
+    }
+
+    unsigned int values[6];
+    for(int i = 0; i < 6; i++)
+    {
+        if(i > 0)
+        {
+            if(text == end || *text != ',')
+            {
+                return false;
+            }
+            text++;
+        }
+
+        unsigned int value = 0;
+        int digits = 0;
+        while(text < end && *text >= '0' && *text <= '9' && digits < 4)
+        {
+            value = value * 10 + (*text - '0');
+            text++;
+            digits++;
+        }
+        if(digits == 0 || value > 255)
+        {
+            return false;
+        }
+        values[i] = value;
+    }
+
+    *address = (values[0] << 24) | (values[1] << 16) | (values[2] << 8) | values[3];
+    *port = (uint16_t)((values[4] << 8) | values[5]);
+    return *port != 0;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include "ftpreply.h"
+
+/**
+ *  fuzz_reply.cpp
+ * 
+ *  libFuzzer target for the reply parsing in ftpreply.h,
+ *  which reads whatever the server sends. Build and run
+ *  with ./fuzzscript.sh (needs clang).
+ * 
+ *  Built with -DFUZZ_STANDALONE instead, it runs each file
+ *  named on the command line once, for replaying a crash
+ *  or corpus without libFuzzer.
+ */
+
+/**
+ *  LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+ * 
+ *  Feeds one input to every parser. The input is copied so
+ *  that reading past its end is caught by AddressSanitizer.
+ * 
+ *  @param data Fuzzer input
+ *  @param size Bytes in data
+ *  @return 0
+ */
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    std::vector<char> input(data, data + size);
+    const char* text = input.data();
+
+    // Walk the input reply by reply like readReply() does
+    const char* rest = text;
+    size_t left = size;
+    int code;
+    size_t used;
+    while((used = parseReply(rest, left, &code)) > 0)
+    {
+        if(used > left || (code != -1 && (code < 100 || code > 599)))
+        {
+            __builtin_trap();
+        }
+        rest += used;
+        left -= used;
+    }
+
+    lastReplyCode(text, size);
+
+    uint32_t address;
+    uint16_t port;
+    if(parsePasv(text, size, &address, &port) && port == 0)
+    {
+        __builtin_trap();
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char* argv[])
+{
+    for(int i = 1; i < argc; i++)
+    {
+        FILE* file = fopen(argv[i], "rb");
+        if(file == NULL)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+
+        std::vector<uint8_t> input;
+        int c;
+        while((c = fgetc(file)) != EOF)
+        {
+            input.push_back((uint8_t)c);
+        }
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    return 0;
+}
+#endif
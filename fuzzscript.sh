@@ -0,0 +1,2 @@
+clang++ -g -O1 -fsanitize=fuzzer,address,undefined fuzz_reply.cpp -o fuzz_reply
+./fuzz_reply -max_total_time=60
\ No newline at end of file